@@ -0,0 +1,25 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2024
+// SPDX-License-Identifier: Apache-2.0
+
+// Stand-in for the Arduino core and V2Base, to build the library outside of a
+// board. The clock is simulated and advanced by the caller.
+#pragma once
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace V2Base {
+  inline uint32_t& getClock() {
+    static uint32_t usec;
+    return usec;
+  }
+
+  inline uint32_t getUsec() {
+    return getClock();
+  }
+
+  inline uint32_t getUsecSince(uint32_t usec) {
+    return getClock() - usec;
+  }
+};
@@ -0,0 +1,166 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2024
+// SPDX-License-Identifier: Apache-2.0
+
+// Runs one detector path for a number of samples. Without arguments, the names
+// of the paths are printed. The cost per sample is the difference to a run of
+// the same path with zero samples, see run.sh.
+#include "V2Drum.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(V2DRUM_BENCHMARK_HOST)
+  #include <chrono>
+#endif
+
+namespace {
+  class Pad : public V2Drum {
+  public:
+    constexpr Pad(const struct Config* config, float (*signal)(uint32_t n)) : V2Drum(config), _signal(signal) {}
+
+  private:
+    float (*_signal)(uint32_t n);
+    uint32_t _n{};
+
+    float handleMeasurement() override {
+      return _signal(_n++);
+    }
+  };
+
+  struct Path {
+    const char* name;
+
+    // The detector configuration and the simulated input.
+    void (*configure)(V2Drum::Config* config);
+    float (*signal)(uint32_t n);
+
+    // The simulated time between two samples.
+    uint32_t      periodUsec;
+    V2Drum::Level level;
+  };
+
+  void configureDefault(V2Drum::Config* config) {
+    config->nSteps                = 128;
+    config->alpha                 = 0.5;
+    config->lag                   = 0.01;
+    config->pressure.min          = 0.05;
+    config->pressure.max          = 0.9;
+    config->pressure.exponent     = 2;
+    config->hit.min               = 0.1;
+    config->hit.max               = 0.9;
+    config->hit.exponent          = 1.5;
+    config->hit.risingUsec        = 2000;
+    config->hit.holdUsec          = 5000;
+    config->hit.pressureDelayUsec = 1000 * 1000 * 1000;
+    config->hit.releaseUsec       = 5000;
+    config->release.minUsec       = 1000;
+    config->release.maxUsec       = 50000;
+  }
+
+  // Stay in 'Rising'.
+  void configureRising(V2Drum::Config* config) {
+    configureDefault(config);
+    config->hit.risingUsec = 1000 * 1000 * 1000;
+  }
+
+  // Reject every rising edge, stay in 'Release' with pressure events.
+  void configurePressure(V2Drum::Config* config) {
+    configureDefault(config);
+    config->hit.min = 0.95;
+  }
+
+  void configureBipolar(V2Drum::Config* config) {
+    configureDefault(config);
+    config->bipolar.enabled = true;
+    config->bipolar.bias    = 0.5;
+    config->bipolar.attack  = 1;
+    config->bipolar.release = 0.05;
+  }
+
+  void configureRingdown(V2Drum::Config* config) {
+    configureDefault(config);
+    config->hit.decayUsec = 8000;
+  }
+
+  float signalZero(uint32_t n) {
+    return 0;
+  }
+
+  float signalBias(uint32_t n) {
+    return 0.5;
+  }
+
+  float signalConstant(uint32_t n) {
+    return 0.5;
+  }
+
+  // A hit, followed by constant pressure.
+  float signalHold(uint32_t n) {
+    return n < 4 ? 0.8 : 0.5;
+  }
+
+  // Alternating pressure, every sample changes the step.
+  float signalPressure(uint32_t n) {
+    return n & 1 ? 0.6 : 0.3;
+  }
+
+  const Path paths[] = {
+    {"idle", configureDefault, signalZero, 500, V2Drum::Level::Full},
+    {"idle-bipolar", configureBipolar, signalBias, 500, V2Drum::Level::Full},
+    {"idle-slow", configureDefault, signalZero, 500, V2Drum::Level::SlowIdle},
+    {"rising", configureRising, signalConstant, 500, V2Drum::Level::Full},
+    {"hold", configureDefault, signalHold, 500, V2Drum::Level::Full},
+    {"hold-ringdown", configureRingdown, signalHold, 500, V2Drum::Level::Full},
+    {"pressure", configurePressure, signalPressure, 20 * 1000, V2Drum::Level::Full},
+    {"pressure-fastcurve", configurePressure, signalPressure, 20 * 1000, V2Drum::Level::FastCurve},
+  };
+};
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    for (const Path& path : paths)
+      printf("%s\n", path.name);
+
+    return 0;
+  }
+
+  const Path* path = nullptr;
+  for (const Path& p : paths)
+    if (strcmp(p.name, argv[1]) == 0)
+      path = &p;
+
+  if (!path) {
+    printf("Unknown path: %s\n", argv[1]);
+    return 1;
+  }
+
+  const uint32_t nSamples = strtoul(argv[2], nullptr, 10);
+
+  static V2Drum::Config config{};
+  path->configure(&config);
+
+  static Pad pad(&config, path->signal);
+  pad.setLevel(path->level);
+
+  // Reach the steady state of the path.
+  for (uint8_t i = 0; i < 64; i++) {
+    V2Base::getClock() += path->periodUsec;
+    pad.loop();
+  }
+
+#if defined(V2DRUM_BENCHMARK_HOST)
+  const auto start = std::chrono::steady_clock::now();
+#endif
+
+  for (uint32_t i = 0; i < nSamples; i++) {
+    V2Base::getClock() += path->periodUsec;
+    pad.loop();
+  }
+
+#if defined(V2DRUM_BENCHMARK_HOST)
+  const auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  if (nSamples > 0)
+    printf("%-20s %8.1f ns/sample\n", path->name, (double)nsec / nSamples);
+#endif
+
+  return 0;
+}
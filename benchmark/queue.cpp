@@ -0,0 +1,143 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2024
+// SPDX-License-Identifier: Apache-2.0
+
+// Contention of the event queue on the host. Every producer thread simulates
+// the scans of one ADC with its own phase; a scan is a busy loop, followed by
+// a push of one event and the publishing of the scan timestamp as the
+// watermark. One consumer thread pops the events concurrently.
+//
+// The cost of a push is the difference of the time per scan to a run of the
+// same scans without the queue. The cost of a pop is measured around every
+// successful pop, minus the cost of reading the clock. Reports the dropped
+// events, and the popped events which are not in global timestamp order. The
+// host needs a core for every thread, otherwise the threads are time-sliced
+// and the consumer falls behind.
+#include "V2DrumQueue.h"
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+namespace {
+  constexpr uint32_t periodUsec = 500;
+
+  using Clock = std::chrono::steady_clock;
+
+  double getNsec(Clock::time_point start, Clock::time_point end = Clock::now()) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+  }
+
+  // The simulated work of a scan.
+  void scan(uint32_t nWork) {
+    for (volatile uint32_t i = 0; i < nWork; i++)
+      ;
+  }
+
+  // The time per scan of a producer without the queue.
+  double getScanNsec(uint32_t nScans, uint32_t nWork) {
+    const auto start = Clock::now();
+    for (uint32_t n = 0; n < nScans; n++)
+      scan(nWork);
+
+    return getNsec(start) / nScans;
+  }
+
+  double getClockNsec() {
+    const uint32_t n     = 1000 * 1000;
+    double         nsec  = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      const auto start = Clock::now();
+      nsec += getNsec(start);
+    }
+
+    return nsec / n;
+  }
+
+  template <uint8_t nProducers> void run(uint32_t nScans, uint32_t nWork, double scanNsec, double clockNsec) {
+    static V2DrumQueue<nProducers, 1024> queue;
+    std::atomic<uint8_t>                 nRunning{nProducers};
+    double                               pushNsec[nProducers]{};
+
+    std::thread producers[nProducers];
+    for (uint8_t i = 0; i < nProducers; i++) {
+      producers[i] = std::thread([&, i] {
+        const auto start = Clock::now();
+
+        for (uint32_t n = 0; n < nScans; n++) {
+          scan(nWork);
+
+          // The scans of the producers are interleaved.
+          const uint32_t usec = n * periodUsec + i * (periodUsec / nProducers);
+          queue.push(i, {usec, (uint16_t)n, i, V2Drum::Event::Type::Hit, V2Drum::State::Idle});
+          queue.publish(i, usec);
+        }
+
+        pushNsec[i] = getNsec(start) / nScans - scanNsec;
+
+        // Release the remaining events.
+        queue.publish(i, UINT32_MAX / 2);
+        nRunning--;
+      });
+    }
+
+    uint32_t nPopped    = 0;
+    uint32_t nUnordered = 0;
+    uint32_t last       = 0;
+    double   popNsec    = 0;
+    for (;;) {
+      const bool    running = nRunning > 0;
+      V2Drum::Event event;
+
+      const auto start = Clock::now();
+      if (!queue.pop(&event)) {
+        if (!running)
+          break;
+
+        continue;
+      }
+
+      popNsec += getNsec(start) - clockNsec;
+
+      if (nPopped > 0 && (int32_t)(event.usec - last) < 0)
+        nUnordered++;
+
+      last = event.usec;
+      nPopped++;
+    }
+
+    for (auto& producer : producers)
+      producer.join();
+
+    double   push     = 0;
+    uint32_t nDropped = 0;
+    for (uint8_t i = 0; i < nProducers; i++) {
+      push += pushNsec[i] / nProducers;
+      nDropped += queue.getDropped(i);
+    }
+
+    printf("producers %u %8.1f ns/push %8.1f ns/pop %9u popped %9u dropped %9u unordered\n",
+           nProducers,
+           push,
+           nPopped > 0 ? popNsec / nPopped : 0,
+           nPopped,
+           nDropped,
+           nUnordered);
+  }
+};
+
+// Arguments: the number of scans per producer, the iterations of the busy loop
+// of a scan.
+int main(int argc, char** argv) {
+  const uint32_t nScans = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000 * 1000;
+  const uint32_t nWork  = argc > 2 ? strtoul(argv[2], nullptr, 10) : 200;
+
+  const double scanNsec  = getScanNsec(nScans, nWork);
+  const double clockNsec = getClockNsec();
+  printf("%.1f ns/scan without the queue\n", scanNsec);
+
+  run<1>(nScans, nWork, scanNsec, clockNsec);
+  run<2>(nScans, nWork, scanNsec, clockNsec);
+  run<4>(nScans, nWork, scanNsec, clockNsec);
+  return 0;
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+# © Kay Sievers <kay@versioduo.com>, 2020-2024
+# SPDX-License-Identifier: Apache-2.0
+#
+# Build the benchmark for the host and for Cortex-M0+/M4. The host build reports
+# the time per sample, and the contention of the event queue with threads. The Cortex-M builds run under qemu-arm with the TCG
+# 'insn' plugin, which counts the executed instructions; the instructions per
+# sample are the difference between a run with SAMPLES samples and one with
+# zero samples. The cycles are estimated from the instructions with a rough
+# cycles-per-instruction factor of the core.
+#
+# Requires: c++, arm-none-eabi-g++ with newlib (rdimon), qemu-arm with plugins.
+#   QEMU_PLUGIN_INSN  path to libinsn.so
+#   SAMPLES           number of samples per run (10000)
+#   CPI_M0PLUS        estimated cycles per instruction of Cortex-M0+ (1.4)
+#   CPI_M4            estimated cycles per instruction of Cortex-M4 (1.2)
+
+set -e
+
+cd "$(dirname "$0")"
+SAMPLES=${SAMPLES:-10000}
+CPI_M0PLUS=${CPI_M0PLUS:-1.4}
+CPI_M4=${CPI_M4:-1.2}
+FLAGS="-std=c++17 -O2 -I. -I../src -fno-exceptions -fno-rtti"
+
+mkdir -p build
+
+echo "host:"
+c++ $FLAGS -DV2DRUM_BENCHMARK_HOST benchmark.cpp -o build/host
+PATHS=$(build/host)
+for path in $PATHS; do
+  build/host "$path" "$SAMPLES"
+done
+
+echo "host queue:"
+c++ -std=c++17 -O2 -I. -I../src -pthread queue.cpp -o build/queue
+build/queue
+
+if [ -z "$QEMU_PLUGIN_INSN" ]; then
+  echo "QEMU_PLUGIN_INSN is not set, skipping the Cortex-M builds." >&2
+  exit 0
+fi
+
+# Print the number of executed instructions.
+count() {
+  qemu-arm -cpu "$1" -plugin "$QEMU_PLUGIN_INSN" -d plugin "$2" "$3" "$4" 2>&1 |
+    sed -n 's/.*insns: \([0-9]*\).*/\1/p' | tail -n 1
+}
+
+# Name, GCC CPU flags, QEMU CPU, estimated cycles per instruction.
+benchmark() {
+  arm-none-eabi-g++ $FLAGS $2 -mthumb -specs=rdimon.specs benchmark.cpp -o "build/$1" -lrdimon
+
+  echo "$1:"
+  for path in $PATHS; do
+    base=$(count "$3" "build/$1" "$path" 0)
+    total=$(count "$3" "build/$1" "$path" "$SAMPLES")
+    awk -v name="$path" -v base="$base" -v total="$total" -v n="$SAMPLES" -v cpi="$4" 'BEGIN {
+      insns = (total - base) / n
+      printf("%-20s %8.1f instructions/sample %8.1f cycles/sample\n", name, insns, insns * cpi)
+    }'
+  done
+}
+
+benchmark cortex-m0plus "-mcpu=cortex-m0plus" cortex-m0 "$CPI_M0PLUS"
+benchmark cortex-m4 "-mcpu=cortex-m4 -mfloat-abi=hard -mfpu=fpv4-sp-d16" cortex-m4 "$CPI_M4"
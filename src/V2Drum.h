@@ -4,8 +4,101 @@
 #pragma once
 #include <Arduino.h>
 
+// Profiling of the detector paths. Define V2DRUM_CYCLES to an expression which
+// reads a free-running, incrementing cycle counter, e.g. on Cortex-M4/M7:
+//   #define V2DRUM_CYCLES (DWT->CYCCNT)
+// Cortex-M0+ has no cycle counter, a timer running at the CPU clock can be used.
+// The application callbacks and the snapshot publishing are not counted, the
+// measurement callback is counted separately.
+#if defined(V2DRUM_CYCLES)
+  #define V2DRUM_UNCOUNTED(call)                                     \
+    do {                                                             \
+      const uint32_t uncounted = V2DRUM_CYCLES;                      \
+      call;                                                          \
+      _cycles.uncounted += (uint32_t)(V2DRUM_CYCLES) - uncounted;    \
+    } while (0)
+#else
+  #define V2DRUM_UNCOUNTED(call) call
+#endif
+
+// Static tracepoints for perf/bpftrace on Linux hosts. Define V2DRUM_USDT to
+// compile them in. Every probe has a semaphore which the tracer increments when
+// it attaches; until then, a probe costs a test of the semaphore, its arguments
+// are not computed. <sys/sdt.h> must not be included before this header.
+//
+// The first argument is the address of the pad object, the key to tell the pads
+// apart; the application can log the address of every pad to map it to a pad
+// number. The second argument is the timestamp. The 'overflow' probe carries the
+// address of the queue, the timestamp and the producer.
+#if defined(V2DRUM_USDT)
+  #define _SDT_HAS_SEMAPHORES 1
+  #include <sys/sdt.h>
+
+extern "C" {
+  #define V2DRUM_SEMAPHORE(name) __attribute__((weak, section(".probes"))) volatile uint16_t v2drum_##name##_semaphore
+  V2DRUM_SEMAPHORE(sample);
+  V2DRUM_SEMAPHORE(state);
+  V2DRUM_SEMAPHORE(hit);
+  V2DRUM_SEMAPHORE(release);
+  V2DRUM_SEMAPHORE(pressure);
+  V2DRUM_SEMAPHORE(overflow);
+  #undef V2DRUM_SEMAPHORE
+}
+
+  #define V2DRUM_PROBE(name, ...)                          \
+    do {                                                   \
+      if (__builtin_expect(v2drum_##name##_semaphore, 0)) \
+        STAP_PROBEV(v2drum, name, __VA_ARGS__);            \
+    } while (0)
+#else
+  #define V2DRUM_PROBE(...)
+#endif
+
 class V2Drum {
 public:
+  // Features of the rising edge, 0..127.
+  enum class Feature : uint8_t {
+    // Time to reach the peak, relative to hit.risingUsec.
+    Rise,
+
+    // Maximum pressure.
+    Peak,
+
+    // Maximum increase of the pressure between two samples.
+    Slope,
+
+    // Number of direction changes; zero crossings of the slope.
+    Crossings,
+
+    _count
+  };
+
+  struct Features {
+    int8_t values[(uint8_t)Feature::_count];
+  };
+
+  // Decision tree node. Continue with 'left' if the feature value is smaller or
+  // equal to the threshold, otherwise with 'right'. A leaf has the 'feature'
+  // value 'Leaf' and carries the class in 'threshold'.
+  //
+  // A tree is trained offline from labeled recordings of getFeatures(), one
+  // 0..127 value per Feature, in the order of the enum. It is exported as a
+  // constant array with the root at index 0, the children must follow their
+  // parent, e.g. in pre-order or breadth-first order. The branch nodes carry the
+  // Feature index and an integer threshold; the leaves carry 'Reject' or an
+  // application-defined articulation 1..127. A malformed tree, a child index
+  // outside of the array or before its parent, or an invalid feature, rejects
+  // the hit.
+  struct Node {
+    uint8_t feature;
+    int8_t  threshold;
+    uint8_t left;
+    uint8_t right;
+  };
+
+  static constexpr uint8_t Leaf   = 0xff;
+  static constexpr int8_t  Reject = 0;
+
   struct Config {
     // The number of steps to map the measurement to. 128 steps will emit values
     // from 0 to 127.
@@ -18,6 +111,20 @@ public:
     // The unit is a fraction of the normalized 0..1 value of the min..max range.
     float lag;
 
+    struct {
+      // Accept signed measurements of a piezo biased at the middle of the analog
+      // range. The value is full-wave rectified and its envelope is measured.
+      bool enabled;
+
+      // The normalized 0..1 value of the zero level, usually 0.5.
+      float bias;
+
+      // Envelope smoothing constants for the rising and falling input, 1 follows
+      // the rectified input immediately.
+      float attack;
+      float release;
+    } bipolar;
+
     struct {
       // The normalized 0..1 value of the analog measurement range.
       float min;
@@ -48,6 +155,24 @@ public:
 
       // Time for the release to settle.
       uint32_t releaseUsec;
+
+      // Initial time constant of the exponential decay of the piezo after a hit.
+      // The expected ring-down is subtracted from the measurement during 'HitHold',
+      // and pressure events are enabled right after holdUsec instead of
+      // pressureDelayUsec. The time constant adapts to the measured decay. Zero
+      // disables the ring-down subtraction.
+      uint32_t decayUsec;
+
+      // Shortest hold and release times. The times are scaled between the minimum
+      // and holdUsec/releaseUsec by the velocity of the hit, and limited to a
+      // quarter of the recent inter-onset interval. Soft, fast strokes get short
+      // windows, loud single hits long ones. Zero disables the adaptation.
+      uint32_t holdMinUsec;
+      uint32_t releaseMinUsec;
+
+      // Reconstruct the peak between the samples by fitting a parabola through
+      // the maximum and its neighbours, instead of using the largest sample.
+      bool interpolate;
     } hit;
 
     struct {
@@ -55,8 +180,119 @@ public:
       float minUsec;
       float maxUsec;
     } release;
+
+    struct {
+      // Freeze the recorder if two hits follow each other within this timespan.
+      uint32_t doubleHitUsec;
+
+      // Freeze the recorder if a hit follows a slow-rise rejection within this timespan.
+      uint32_t slowRiseUsec;
+
+      // Freeze the recorder if 'HitHold' lasts longer than this.
+      uint32_t stuckHoldUsec;
+    } recorder;
+
+    struct {
+      // Decision tree, evaluated with the features of the rising edge. The first
+      // node is the root. A 'Reject' result drops the hit, all other values
+      // are returned as the articulation. NULL disables the classifier.
+      const Node* nodes;
+      uint8_t     nNodes;
+    } classifier;
+  };
+
+  enum class State : uint8_t {
+    // No pressure detected.
+    Idle,
+
+    // Pressure rising, measured in a short timeframe. The minimum hit value
+    // needs to be reached in this timeframe, a slow-rising value is a pressure
+    // change only.
+    Rising,
+
+    // Hit event, with the maximum value of the measured pressure as velocity.
+    Hit,
+
+    // Active hit.
+    HitHold,
+
+    // Hit release event (velocity == 0).
+    HitRelease,
+
+    // Reset, wait for the pressure to be fully released and settled.
+    Release
   };
 
+  // Detector output, to be queued or exported.
+  struct Event {
+    enum class Type : uint8_t {
+      Hit,
+      Release,
+      Pressure,
+      State,
+    };
+
+    uint32_t usec;
+
+    // The velocity or the pressure step.
+    uint16_t value;
+    uint8_t  pad;
+    Type     type;
+    State    state;
+  };
+
+  // Work shedding under CPU load; every level includes the previous ones.
+  enum class Level : uint8_t {
+    // Full processing.
+    Full,
+
+    // Do not emit pressure events.
+    NoPressure,
+
+    // Approximate the correction curve while only pressure is measured.
+    FastCurve,
+
+    // Scan idle pads at a quarter of the rate; delays the detection of the
+    // rising edge by up to three sample periods.
+    SlowIdle,
+  };
+
+  // Consistent copy of the pad state, to be read from a different context.
+  struct Snapshot {
+    State    state;
+    float    fraction;
+    uint16_t step;
+
+    // The last hit; kept after the pad returned to 'Idle'. The release time is
+    // zero while the hit is held.
+    uint8_t  velocity;
+    uint32_t hitUsec;
+    uint32_t releaseUsec;
+  };
+
+  // The suspicious pattern which froze the recorder.
+  enum class Anomaly : uint8_t {
+    None,
+    DoubleHit,
+    SlowRiseHit,
+    StuckHold,
+  };
+
+  // Activity summary of a chunk of recorded samples.
+  struct Chunk {
+    // The index of the first sample of the chunk in the readRecorder() buffer.
+    uint32_t offset;
+
+    // The maximum amplitude; for bipolar input the distance from the bias.
+    uint16_t max;
+
+    // The number of detected hits, counted in the chunk of their rising edge.
+    uint8_t nOnsets;
+  };
+
+  // The number of samples summarized in one chunk.
+  static constexpr uint16_t nChunkSamples = 64;
+
   constexpr V2Drum(const struct Config* config) : _config(config) {}
   void begin() {}
 
@@ -67,26 +303,116 @@ public:
     _rising   = {};
     _hit      = {};
     _falling  = {};
+    _last     = {};
+    _ringdown = {};
+    _density  = {};
+    resumeRecorder();
+  }
+
+  // Record the last raw measurements into a circular buffer, 0..65535 for the
+  // normalized 0..1 value. The number of samples must be a power of two. The
+  // optional index needs nSamples / nChunkSamples entries, it is ignored for
+  // buffers smaller than a chunk.
+  void setRecorder(uint16_t* samples, uint16_t nSamples, Chunk* chunks = nullptr) {
+    _recorder         = {};
+    _recorder.samples = samples;
+    _recorder.mask    = nSamples - 1;
+
+    // A buffer smaller than a chunk has no index.
+    if (nSamples >= nChunkSamples)
+      _recorder.chunks = chunks;
+  }
+
+  // Start recording again after an anomaly froze the buffer.
+  void resumeRecorder() {
+    _recorder.position = 0;
+    _recorder.chunk    = {};
+    _recorder.hitUsec  = 0;
+    _recorder.slowUsec = 0;
+    _recorder.anomaly  = Anomaly::None;
+  }
+
+  Anomaly getAnomaly() {
+    return _recorder.anomaly;
+  }
+
+  // Copy the recorded samples, the oldest one first. Returns the number of samples.
+  uint16_t readRecorder(uint16_t* samples, uint16_t nSamples) {
+    if (!_recorder.samples)
+      return 0;
+
+    const uint32_t size  = (uint32_t)_recorder.mask + 1;
+    uint32_t       count = _recorder.position < size ? _recorder.position : size;
+    if (count > nSamples)
+      count = nSamples;
+
+    const uint32_t first = _recorder.position - count;
+    for (uint32_t i = 0; i < count; i++)
+      samples[i] = _recorder.samples[(first + i) & _recorder.mask];
+
+    return count;
+  }
+
+  // Copy the summaries of the completed chunks of the full recorder buffer, the
+  // oldest one first. Silent chunks can be skipped without reading their samples.
+  // Returns the number of chunks.
+  uint16_t readRecorderIndex(Chunk* chunks, uint16_t nChunks) {
+    if (!_recorder.samples || !_recorder.chunks)
+      return 0;
+
+    const uint32_t size  = (uint32_t)_recorder.mask + 1;
+    const uint32_t first = _recorder.position < size ? 0 : _recorder.position - size;
+
+    // The first chunk entirely inside the buffer.
+    uint32_t start = (first + nChunkSamples - 1) & ~(uint32_t)(nChunkSamples - 1);
+
+    uint16_t count = 0;
+    for (; start + nChunkSamples <= _recorder.position && count < nChunks; start += nChunkSamples) {
+      chunks[count]        = _recorder.chunks[(start & _recorder.mask) / nChunkSamples];
+      chunks[count].offset = start - first;
+      count++;
+    }
+
+    return count;
   }
 
   // Measure and emit pressure events. A fast rising edge will emit a hit event,
   // the release to idle will clear it.
   void loop() {
-    if (V2Base::getUsecSince(_now.usec) < 500)
+    if (V2Base::getUsecSince(_now.usec) < _periodUsec)
+      return;
+
+    // Scan idle pads at a lower rate.
+    if (_level >= Level::SlowIdle && _now.state == State::Idle && V2Base::getUsecSince(_now.usec) < _periodUsec * 4)
       return;
 
     _now.usec = V2Base::getUsec();
 
+    const State state = _now.state;
+
+#if defined(V2DRUM_CYCLES)
+    const uint32_t cycles = V2DRUM_CYCLES;
+    _cycles.emitted       = false;
+    _cycles.uncounted     = 0;
+#endif
+
     measure();
-    sendPressure();
+    if (_level < Level::NoPressure)
+      sendPressure();
 
     switch (_now.state) {
       case State::Idle:
         if (_now.step == 0)
           break;
 
-        _rising.usec = V2Base::getUsec();
-        _now.state   = State::Rising;
+        _rising.usec       = V2Base::getUsec();
+        _rising.position   = _recorder.position - 1;
+        _rising.peakUsec   = _rising.usec;
+        _rising.analog     = _history.analog;
+        _rising.analogUsec = _rising.usec;
+        _features          = {};
+        _features.previous = _now.fraction;
+        _now.state         = State::Rising;
         break;
 
       case State::Rising:
@@ -96,24 +422,55 @@ public:
         }
 
         // Remember the maximum value, it might bounce.
-        if (_now.fraction > _rising.pressure)
+        if (_now.fraction > _rising.pressure) {
+          _rising.left     = _features.previous;
           _rising.pressure = _now.fraction;
+          _rising.peakUsec = V2Base::getUsec();
+          _rising.falling  = false;
+
+        } else if (!_rising.falling) {
+          _rising.right   = _now.fraction;
+          _rising.falling = true;
+        }
+
+        if (_history.analog > _rising.analog) {
+          _rising.analog     = _history.analog;
+          _rising.analogUsec = V2Base::getUsec();
+        }
+
+        measureFeatures();
 
         // Sample timespan.
         if (V2Base::getUsecSince(_rising.usec) < _config->hit.risingUsec)
           break;
 
+        quantizeFeatures();
+
         // Require minimum rise distance. If we rise too slow, it is not a hit.
         if (_rising.pressure <= _config->hit.min) {
-          _pressure.enabled = true;
-          _now.state        = State::Release;
+          _pressure.enabled  = true;
+          _recorder.slowUsec = V2Base::getUsec();
+          _now.state         = State::Release;
           break;
         }
 
+        if (_config->classifier.nodes) {
+          _hit.articulation = classify();
+
+          // Not a stroke; a mechanical bump, crosstalk, or a cable knock.
+          if (_hit.articulation == Reject) {
+            _now.state = State::Release;
+            break;
+          }
+        }
+
         _now.state = State::Hit;
         break;
 
       case State::Hit: {
+        if (_config->hit.interpolate && _rising.falling)
+          interpolatePeak();
+
         // Normalized 0..1 fraction of the min..max range.
         if (_rising.pressure > _config->hit.max)
           _rising.pressure = _config->hit.max;
@@ -125,8 +482,35 @@ public:
 
         _hit.velocity = ceilf(fraction * (_config->nSteps - 1));
         _hit.usec     = V2Base::getUsec();
+        _last         = {_hit.velocity, _hit.usec, 0};
         _now.state    = State::HitHold;
-        handleHit(_hit.velocity);
+
+        if (_recorder.hitUsec > 0 && _hit.usec - _recorder.hitUsec < _config->recorder.doubleHitUsec)
+          freezeRecorder(Anomaly::DoubleHit);
+
+        else if (_recorder.slowUsec > 0 && _hit.usec - _recorder.slowUsec < _config->recorder.slowRiseUsec)
+          freezeRecorder(Anomaly::SlowRiseHit);
+
+        _recorder.hitUsec = _hit.usec;
+        adaptWindows();
+        countOnset();
+
+        // Start the expected ring-down at the peak of the hit. The peak happened
+        // up to risingUsec ago, decay it to the time of the next sample, the
+        // first one it is subtracted from.
+        if (_config->hit.decayUsec > 0) {
+          if (_ringdown.decayUsec == 0.f)
+            _ringdown.decayUsec = _config->hit.decayUsec;
+
+          const float elapsed = (float)(_hit.usec - _rising.analogUsec + _periodUsec);
+          _ringdown.peak      = _rising.analog;
+          _ringdown.peakUsec  = _rising.analogUsec;
+          _ringdown.analog    = _rising.analog * expf(-elapsed / _ringdown.decayUsec);
+          _ringdown.factor    = expf(-(float)_periodUsec / _ringdown.decayUsec);
+        }
+
+        V2DRUM_PROBE(hit, this, _hit.usec, _hit.velocity);
+        V2DRUM_UNCOUNTED(handleHit(_hit.velocity));
       } break;
 
       case State::HitHold:
@@ -135,9 +519,15 @@ public:
           _falling.usec = V2Base::getUsec();
         }
 
-        if (V2Base::getUsecSince(_hit.holdUsec) < _config->hit.holdUsec)
+        if (_config->recorder.stuckHoldUsec > 0 && V2Base::getUsecSince(_hit.holdUsec) > _config->recorder.stuckHoldUsec)
+          freezeRecorder(Anomaly::StuckHold);
+
+        if (V2Base::getUsecSince(_hit.holdUsec) < getHoldUsec())
           break;
 
+        if (_ringdown.peak > 0.f)
+          learnDecay();
+
         // Clear the falling duration whenever the pressure rises again.
         if (_now.step >= _falling.step) {
           _falling.usec = V2Base::getUsec();
@@ -146,17 +536,20 @@ public:
 
         if (_now.step == 0) {
           _pressure.enabled = true;
+          _ringdown.analog  = 0;
           _now.state        = State::HitRelease;
           break;
         }
 
         // If we stay in 'Hold', enable the pressure events only after the delay timespan.
-        if (V2Base::getUsecSince(_hit.holdUsec) > _config->hit.pressureDelayUsec)
+        // The subtracted ring-down does not look like pressure, no delay is needed.
+        if (_config->hit.decayUsec > 0 || V2Base::getUsecSince(_hit.holdUsec) > _config->hit.pressureDelayUsec)
           _pressure.enabled = true;
         break;
 
       case State::HitRelease: {
-        _hit.releaseUsec = V2Base::getUsec();
+        _hit.releaseUsec  = V2Base::getUsec();
+        _last.releaseUsec = _hit.releaseUsec;
 
         uint32_t duration = _hit.releaseUsec - _falling.usec;
         if (duration > _config->release.maxUsec)
@@ -169,7 +562,8 @@ public:
         _falling.velocity    = 127 - (fraction * 126.f);
 
         _now.state = State::Release;
-        handleRelease(_falling.velocity);
+        V2DRUM_PROBE(release, this, _hit.releaseUsec, _falling.velocity);
+        V2DRUM_UNCOUNTED(handleRelease(_falling.velocity));
       } break;
 
       case State::Release:
@@ -177,7 +571,7 @@ public:
           break;
 
         // Wait for the release to settle.
-        if (V2Base::getUsecSince(_hit.releaseUsec) < _config->hit.releaseUsec)
+        if (V2Base::getUsecSince(_hit.releaseUsec) < getReleaseUsec())
           break;
 
         _now    = {};
@@ -185,15 +579,127 @@ public:
         _hit    = {};
 
         // Make sure we send zeros if we sent out non-zero values.
-        if (_pressure.sent)
-          handlePressure(0, 0);
+        if (_pressure.sent) {
+          V2DRUM_PROBE(pressure, this, V2Base::getUsec(), 0);
+          V2DRUM_UNCOUNTED(handlePressure(0, 0));
+        }
 
         if (_pressure.rawSent)
-          handlePressureRaw(0, 0);
+          V2DRUM_UNCOUNTED(handlePressureRaw(0, 0));
         _pressure = {};
 
         break;
     }
+
+    V2DRUM_UNCOUNTED(publishSnapshot());
+
+    if (_now.state != state) {
+      V2DRUM_PROBE(state, this, _now.usec, (uint8_t)state, (uint8_t)_now.state);
+      V2DRUM_UNCOUNTED(handleState(_now.state));
+    }
+
+#if defined(V2DRUM_CYCLES)
+    {
+      const uint32_t duration = (uint32_t)(V2DRUM_CYCLES) - cycles - _cycles.uncounted;
+
+      // Pressure updates are counted separately from their state.
+      if (_cycles.emitted)
+        countCycles(&_cycles.pressure, duration);
+
+      else
+        countCycles(&_cycles.state[(uint8_t)state], duration);
+    }
+#endif
+  }
+
+#if defined(V2DRUM_CYCLES)
+  struct Cycles {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+  };
+
+  // The number of cycles of loop() without the callbacks, the path is the state at
+  // its beginning.
+  const Cycles* getCycles(State state) {
+    return &_cycles.state[(uint8_t)state];
+  }
+
+  // The number of cycles of loop() without the callbacks, when a pressure update
+  // was emitted.
+  const Cycles* getPressureCycles() {
+    return &_cycles.pressure;
+  }
+
+  // The number of cycles of handleMeasurement().
+  const Cycles* getMeasurementCycles() {
+    return &_cycles.measurement;
+  }
+
+  void resetCycles() {
+    _cycles = {};
+  }
+#endif
+
+  // Read the state published by the last loop(), without blocking it. Returns
+  // false if no consistent copy could be read, e.g. when interrupting a loop()
+  // which is in the middle of publishing.
+  bool getSnapshot(Snapshot* snapshot) {
+    for (uint8_t i = 0; i < 4; i++) {
+      const uint32_t sequence = __atomic_load_n(&_snapshot.sequence, __ATOMIC_ACQUIRE);
+      if (sequence & 1)
+        continue;
+
+      *snapshot = _snapshot.data;
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&_snapshot.sequence, __ATOMIC_RELAXED) == sequence)
+        return true;
+    }
+
+    return false;
+  }
+
+  // Read the snapshots of all pads of a kit. Returns false if any of the pads
+  // failed to provide a consistent copy.
+  static bool getSnapshots(V2Drum* const* pads, uint8_t nPads, Snapshot* snapshots) {
+    bool success = true;
+    for (uint8_t i = 0; i < nPads; i++)
+      success &= pads[i]->getSnapshot(&snapshots[i]);
+
+    return success;
+  }
+
+  // The features of the last completed rising edge; to be recorded for training a
+  // classifier.
+  const Features* getFeatures() {
+    return &_features.features;
+  }
+
+  // The shortest measured interval between two hits.
+  uint32_t getMinIntervalUsec() {
+    return _density.minIntervalUsec;
+  }
+
+  // The shortest possible interval between two hits with the current windows.
+  uint32_t getAchievableIntervalUsec() {
+    return _config->hit.risingUsec + getHoldUsec() + getReleaseUsec();
+  }
+
+  // No pressure detected, the measurement is the background noise.
+  bool isIdle() {
+    return _now.state == State::Idle;
+  }
+
+  // Set by the governor, depending on the CPU load.
+  void setLevel(Level level) {
+    _level = level;
+  }
+
+  // The class of the current hit, if a classifier is configured.
+  int8_t getArticulation() {
+    return _hit.articulation;
   }
 
   float getFraction() {
@@ -205,7 +711,8 @@ public:
   }
 
 protected:
-  // Normalized 0...1 analog measurement.
+  // Normalized 0...1 analog measurement. In bipolar mode, the zero level is
+  // at the configured bias.
   virtual float handleMeasurement() = 0;
 
   // Sent whenever the step value changes.
@@ -221,30 +728,19 @@ protected:
   // Sent when the 'Hit' is released.
   virtual void handleRelease(uint8_t velocity) {}
 
-private:
-  enum class State {
-    // No pressure detected.
-    Idle,
+  // Sent when an anomaly froze the recorder; the buffer can be retrieved with
+  // readRecorder().
+  virtual void handleAnomaly(Anomaly anomaly) {}
 
-    // Pressure rising, measured in a short timeframe. The minimum hit value
-    // needs to be reached in this timeframe, a slow-rising value is a pressure
-    // change only.
-    Rising,
+  // Sent after every state transition; the state trace of the detector.
+  virtual void handleState(State state) {}
 
-    // Hit event, with the maximum value of the measured pressure as velocity.
-    Hit,
-
-    // Active hit.
-    HitHold,
-
-    // Hit release event (velocity == 0).
-    HitRelease,
-
-    // Reset, wait for the pressure to be fully released and settled.
-    Release
-  };
+private:
+  // The sample period.
+  static constexpr uint32_t _periodUsec = 500;
 
   const struct Config* _config;
+  Level                _level{};
 
   struct {
     State    state;
@@ -260,6 +756,9 @@ private:
 
     // The edge of the lag range, set by the previous value change.
     float lag;
+
+    // The envelope of the rectified bipolar measurement.
+    float envelope;
   } _history{};
 
   struct {
@@ -273,11 +772,43 @@ private:
 
   struct {
     float    pressure;
+    float    analog;
     uint32_t usec;
+    uint32_t peakUsec;
+
+    // The recorder position of the first sample of the rising edge.
+    uint32_t position;
+
+    // The time of the maximum of the smoothed analog value.
+    uint32_t analogUsec;
+
+    // The samples before and after the maximum.
+    float left;
+    float right;
+    bool  falling;
   } _rising{};
 
+  // The vertex of the parabola through the maximum and its neighbours.
+  void interpolatePeak() {
+    const float curvature = _rising.left - 2.f * _rising.pressure + _rising.right;
+    if (curvature >= 0.f)
+      return;
+
+    const float offset = 0.5f * (_rising.left - _rising.right) / curvature;
+    _rising.pressure -= 0.25f * (_rising.left - _rising.right) * offset;
+  }
+
+  struct {
+    float    previous;
+    float    slope;
+    bool     falling;
+    uint8_t  crossings;
+    Features features;
+  } _features{};
+
   struct {
     uint8_t  velocity;
+    int8_t   articulation;
     uint32_t usec;
     uint32_t holdUsec;
     uint32_t releaseUsec;
@@ -289,29 +820,342 @@ private:
     uint8_t  velocity;
   } _falling{};
 
+  struct {
+    uint32_t hitUsec;
+
+    // The smoothed interval between hits.
+    float    intervalUsec;
+    uint32_t minIntervalUsec;
+
+    // The current hold and release times, zero before the first hit.
+    uint32_t holdUsec;
+    uint32_t releaseUsec;
+  } _density{};
+
+  uint32_t getHoldUsec() {
+    return _density.holdUsec > 0 ? _density.holdUsec : _config->hit.holdUsec;
+  }
+
+  uint32_t getReleaseUsec() {
+    return _density.releaseUsec > 0 ? _density.releaseUsec : _config->hit.releaseUsec;
+  }
+
+  // Scale the hold and release times with the velocity and the stroke rate.
+  void adaptWindows() {
+    if (_density.hitUsec > 0) {
+      const uint32_t interval = _hit.usec - _density.hitUsec;
+      if (_density.minIntervalUsec == 0 || interval < _density.minIntervalUsec)
+        _density.minIntervalUsec = interval;
+
+      if (_density.intervalUsec == 0.f)
+        _density.intervalUsec = interval;
+
+      else
+        _density.intervalUsec += ((float)interval - _density.intervalUsec) * 0.25f;
+    }
+
+    _density.hitUsec = _hit.usec;
+
+    if (_config->hit.holdMinUsec == 0 || _config->hit.releaseMinUsec == 0) {
+      _density.holdUsec    = _config->hit.holdUsec;
+      _density.releaseUsec = _config->hit.releaseUsec;
+      return;
+    }
+
+    const float velocity = (float)_hit.velocity / (float)(_config->nSteps - 1);
+    const float limit    = _density.intervalUsec > 0.f ? _density.intervalUsec / 4.f : 1e9f;
+
+    _density.holdUsec    = scaleWindow(_config->hit.holdMinUsec, _config->hit.holdUsec, velocity, limit);
+    _density.releaseUsec = scaleWindow(_config->hit.releaseMinUsec, _config->hit.releaseUsec, velocity, limit);
+  }
+
+  static uint32_t scaleWindow(uint32_t minUsec, uint32_t maxUsec, float velocity, float limitUsec) {
+    float usec = minUsec + (float)(maxUsec - minUsec) * velocity;
+    if (usec > limitUsec)
+      usec = limitUsec;
+
+    if (usec < minUsec)
+      usec = minUsec;
+
+    return usec;
+  }
+
+  // Update the features with the current sample of the rising edge.
+  void measureFeatures() {
+    const float slope   = _now.fraction - _features.previous;
+    const bool  falling = slope < 0.f;
+    _features.previous  = _now.fraction;
+
+    if (falling != _features.falling && _features.crossings < 127)
+      _features.crossings++;
+
+    _features.falling = falling;
+
+    if (slope > _features.slope)
+      _features.slope = slope;
+  }
+
+  // Convert the features at the end of the rising edge.
+  void quantizeFeatures() {
+    const float rise = (float)(_rising.peakUsec - _rising.usec) / (float)_config->hit.risingUsec;
+
+    int8_t* values                      = _features.features.values;
+    values[(uint8_t)Feature::Rise]      = quantize(rise);
+    values[(uint8_t)Feature::Peak]      = quantize(_rising.pressure);
+    values[(uint8_t)Feature::Slope]     = quantize(_features.slope);
+    values[(uint8_t)Feature::Crossings] = _features.crossings;
+  }
+
+  static int8_t quantize(float value) {
+    if (value <= 0.f)
+      return 0;
+
+    if (value >= 1.f)
+      return 127;
+
+    return value * 127.f;
+  }
+
+  // Walk the decision tree. Every step moves forward in the array, the walk
+  // ends after at most 256 nodes.
+  int8_t classify() {
+    const Node* nodes = _config->classifier.nodes;
+    uint8_t     index = 0;
+
+    if (_config->classifier.nNodes == 0)
+      return Reject;
+
+    for (;;) {
+      const Node* node = nodes + index;
+      if (node->feature == Leaf)
+        return node->threshold;
+
+      if (node->feature >= (uint8_t)Feature::_count)
+        return Reject;
+
+      const uint8_t next = _features.features.values[node->feature] <= node->threshold ? node->left : node->right;
+      if (next <= index || next >= _config->classifier.nNodes)
+        return Reject;
+
+      index = next;
+    }
+  }
+
+  struct {
+    // The expected ring-down of the piezo, subtracted from the measurement.
+    float analog;
+
+    // The per-sample decay.
+    float factor;
+
+    // The measured time constant of the decay.
+    float decayUsec;
+
+    // The peak of the current hit and its time, until its decay is measured.
+    float    peak;
+    uint32_t peakUsec;
+  } _ringdown{};
+
+  // Update the time constant from the decay measured from the peak to the end of
+  // the hold time. Pressure during the hold time slows down the measured decay,
+  // the adaptation is slow and limited to a range around the configured value.
+  void learnDecay() {
+    const float ratio = _history.analog / _ringdown.peak;
+    _ringdown.peak    = 0;
+
+    if (ratio <= 0.f || ratio >= 1.f)
+      return;
+
+    float decayUsec = -(float)V2Base::getUsecSince(_ringdown.peakUsec) / logf(ratio);
+    if (decayUsec < _config->hit.decayUsec / 4.f)
+      decayUsec = _config->hit.decayUsec / 4.f;
+
+    else if (decayUsec > _config->hit.decayUsec * 4.f)
+      decayUsec = _config->hit.decayUsec * 4.f;
+
+    _ringdown.decayUsec += (decayUsec - _ringdown.decayUsec) * 0.25f;
+  }
+
+  struct {
+    uint16_t* samples;
+    uint16_t  mask;
+    uint32_t  position;
+    Chunk*    chunks;
+
+    // The summary of the currently recorded chunk.
+    Chunk chunk;
+
+    uint32_t  hitUsec;
+    uint32_t  slowUsec;
+    Anomaly   anomaly;
+  } _recorder{};
+
+  // The last hit, it survives the reset to 'Idle'.
+  struct {
+    uint8_t  velocity;
+    uint32_t hitUsec;
+    uint32_t releaseUsec;
+  } _last{};
+
+  // Seqlock, the sequence number is odd while the data is updated.
+  struct {
+    uint32_t sequence;
+    Snapshot data;
+  } _snapshot{};
+
+#if defined(V2DRUM_CYCLES)
+  struct {
+    Cycles state[(uint8_t)State::Release + 1];
+    Cycles pressure;
+    Cycles measurement;
+
+    // The cycles of the callbacks in the current loop().
+    uint32_t uncounted;
+
+    // A pressure update was emitted in the current loop().
+    bool emitted;
+  } _cycles{};
+
+  static void countCycles(Cycles* c, uint32_t cycles) {
+    if (c->count == 0 || cycles < c->min)
+      c->min = cycles;
+
+    if (cycles > c->max)
+      c->max = cycles;
+
+    c->count++;
+    c->sum += cycles;
+  }
+#endif
+
+  void publishSnapshot() {
+    const uint32_t sequence = _snapshot.sequence;
+    __atomic_store_n(&_snapshot.sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    _snapshot.data.state       = _now.state;
+    _snapshot.data.fraction    = _pressure.fraction;
+    _snapshot.data.step        = _pressure.step;
+    _snapshot.data.velocity    = _last.velocity;
+    _snapshot.data.hitUsec     = _last.hitUsec;
+    _snapshot.data.releaseUsec = _last.releaseUsec;
+
+    __atomic_store_n(&_snapshot.sequence, sequence + 2, __ATOMIC_RELEASE);
+  }
+
+  // Count the hit in the chunk which holds the start of its rising edge.
+  void countOnset() {
+    if (!_recorder.chunks || _recorder.position == 0)
+      return;
+
+    const uint32_t size = (uint32_t)_recorder.mask + 1;
+    if (_recorder.position - _rising.position > size)
+      return;
+
+    if (_rising.position / nChunkSamples == _recorder.position / nChunkSamples)
+      _recorder.chunk.nOnsets++;
+
+    else
+      _recorder.chunks[(_rising.position & _recorder.mask) / nChunkSamples].nOnsets++;
+  }
+
+  void freezeRecorder(Anomaly anomaly) {
+    if (!_recorder.samples || _recorder.anomaly != Anomaly::None)
+      return;
+
+    _recorder.anomaly = anomaly;
+    V2DRUM_UNCOUNTED(handleAnomaly(anomaly));
+  }
+
   void measure() {
+#if defined(V2DRUM_CYCLES)
+    const uint32_t cycles = V2DRUM_CYCLES;
+    _now.analog           = handleMeasurement();
+
+    const uint32_t duration = (uint32_t)(V2DRUM_CYCLES) - cycles;
+    countCycles(&_cycles.measurement, duration);
+    _cycles.uncounted += duration;
+#else
     _now.analog = handleMeasurement();
+#endif
+    V2DRUM_PROBE(sample, this, _now.usec, (uint16_t)(_now.analog * 65535.f));
+
+    // Black-box recording of the raw measurement, until an anomaly freezes it.
+    if (_recorder.samples && _recorder.anomaly == Anomaly::None) {
+      const uint16_t sample = _now.analog * 65535.f;
+      _recorder.samples[_recorder.position & _recorder.mask] = sample;
+
+      if (_recorder.chunks) {
+        uint16_t amplitude = sample;
+        if (_config->bipolar.enabled) {
+          const float distance = fabsf(_now.analog - _config->bipolar.bias) * 2.f;
+          amplitude            = distance < 1.f ? distance * 65535.f : 65535;
+        }
+
+        if (amplitude > _recorder.chunk.max)
+          _recorder.chunk.max = amplitude;
+
+        // Store the summary of the completed chunk.
+        if ((_recorder.position & (nChunkSamples - 1)) == nChunkSamples - 1) {
+          _recorder.chunks[(_recorder.position & _recorder.mask) / nChunkSamples] = _recorder.chunk;
+          _recorder.chunk                                                         = {};
+        }
+      }
+
+      _recorder.position++;
+    }
+
+    // Full-wave rectify around the bias, a full swing is 0..1, and follow the envelope.
+    if (_config->bipolar.enabled) {
+      float rectified = fabsf(_now.analog - _config->bipolar.bias) * 2.f;
+      if (rectified > 1.f)
+        rectified = 1.f;
+
+      if (rectified > _history.envelope)
+        _history.envelope += (rectified - _history.envelope) * _config->bipolar.attack;
+
+      else
+        _history.envelope += (rectified - _history.envelope) * _config->bipolar.release;
+
+      _now.analog = _history.envelope;
+    }
 
     // Low-pass filter, smooth the value.
     _history.analog *= 1 - _config->alpha;
     _history.analog += _now.analog * _config->alpha;
 
-    if (_history.analog < _config->pressure.min) {
+    // Subtract the expected ring-down of the hit.
+    float analog = _history.analog;
+    if (_ringdown.analog > 0.f) {
+      analog -= _ringdown.analog;
+      _ringdown.analog *= _ringdown.factor;
+
+      // Stop before the value becomes denormal, which is slow to compute.
+      if (_ringdown.analog < 1e-6f)
+        _ringdown.analog = 0;
+    }
+
+    if (analog < _config->pressure.min) {
       _now.fraction = 0;
       _now.step     = 0;
       _history.lag  = 0 - _config->lag;
 
-    } else if (_history.analog > _config->pressure.max) {
+    } else if (analog > _config->pressure.max) {
       _now.fraction = 1;
       _now.step     = _config->nSteps - 1;
       _history.lag  = 1 + _config->lag;
 
     } else {
       // Normalized 0..1 fraction of the min..max range.
-      _now.fraction = (_history.analog - _config->pressure.min) / (_config->pressure.max - _config->pressure.min);
+      _now.fraction = (analog - _config->pressure.min) / (_config->pressure.max - _config->pressure.min);
 
-      // Exponential correction curve.
-      _now.fraction = powf(_now.fraction, _config->pressure.exponent);
+      // Exponential correction curve. The hit detection and velocity always use
+      // the exact curve.
+      if (_level >= Level::FastCurve && _pressure.enabled)
+        _now.fraction = powFast(_now.fraction, _config->pressure.exponent);
+
+      else
+        _now.fraction = powf(_now.fraction, _config->pressure.exponent);
 
       // If the new measurement is inside the lag, don't update, use the current step value.
       if (fabs(_now.fraction - _history.lag) >= _config->lag)
@@ -322,6 +1166,22 @@ private:
     }
   }
 
+  // Approximation of powf() for 0..1 values, using the exponent bits of the float
+  // as the logarithm. The relative error grows with the exponent, it reaches 6%
+  // for 0.5, 11% for 2 and 16% for 3.
+  static float powFast(float x, float exponent) {
+    if (x <= 0.f)
+      return 0;
+
+    union {
+      float   f;
+      int32_t i;
+    } u{x};
+
+    u.i = (int32_t)(exponent * (float)(u.i - 1065353216) + 1065353216.f);
+    return u.f;
+  }
+
   void sendPressure() {
     if (_pressure.step == _now.step)
       return;
@@ -347,10 +1207,15 @@ private:
 
     if (_pressure.enabled) {
       _pressure.sent = true;
-      handlePressure(_now.fraction, _now.step);
+      V2DRUM_PROBE(pressure, this, _pressure.usec, _now.step);
+      V2DRUM_UNCOUNTED(handlePressure(_now.fraction, _now.step));
     }
 
     _pressure.rawSent = true;
-    handlePressureRaw(_now.fraction, _now.step);
+    V2DRUM_UNCOUNTED(handlePressureRaw(_now.fraction, _now.step));
+
+#if defined(V2DRUM_CYCLES)
+    _cycles.emitted = true;
+#endif
   }
 };
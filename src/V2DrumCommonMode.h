@@ -0,0 +1,77 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2024
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+#include "V2Drum.h"
+
+// Common-mode noise rejection across the pads of a kit. Ground noise from the
+// power supply or the LED drivers appears on all channels at once. The noise of
+// the current scan is estimated from the idle pads, the pads subtract it from
+// their measurement in handleMeasurement().
+class V2DrumCommonMode {
+public:
+  struct Config {
+    // The normalized 0..1 zero level of the measurements, 0.5 for bipolar input.
+    float bias;
+  };
+
+  constexpr V2DrumCommonMode(const struct Config* config) : _config(config) {}
+
+  void reset() {
+    _offset = 0;
+  }
+
+  // Call with the raw samples of a scan before the pads are measured. A single
+  // pass over the samples; the estimate is the mean of the idle pads without
+  // the smallest and largest value, which drops a pad starting a hit.
+  void update(const float* samples, V2Drum* const* pads, uint8_t nPads) {
+    float   sum   = 0;
+    float   min   = 1;
+    float   max   = 0;
+    uint8_t count = 0;
+
+    for (uint8_t i = 0; i < nPads; i++) {
+      if (!pads[i]->isIdle())
+        continue;
+
+      const float sample = samples[i];
+      sum += sample;
+      if (sample < min)
+        min = sample;
+
+      if (sample > max)
+        max = sample;
+
+      count++;
+    }
+
+    // With fewer than three idle pads, the starting rise of a hit cannot be told
+    // apart from the noise; do not subtract an untrustworthy estimate.
+    if (count < 3) {
+      _offset = 0;
+      return;
+    }
+
+    _offset = (sum - min - max) / (count - 2) - _config->bias;
+  }
+
+  // Remove the common-mode noise from a sample of the current scan.
+  float subtract(float sample) {
+    sample -= _offset;
+    if (sample < 0.f)
+      return 0;
+
+    if (sample > 1.f)
+      return 1;
+
+    return sample;
+  }
+
+  float getOffset() {
+    return _offset;
+  }
+
+private:
+  const struct Config* _config;
+  float                _offset{};
+};
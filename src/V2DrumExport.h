@@ -0,0 +1,134 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2024
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+#include "V2Drum.h"
+#include <stddef.h>
+
+// Columnar export of detector events and state traces. The rows are collected
+// in a fixed-size block, every column is a contiguous array. A full block is
+// written out in one piece, the output is a sequence of self-describing blocks
+// which can be mapped into memory and scanned column by column without parsing.
+template <uint16_t nBlockRows> class V2DrumExport {
+public:
+  enum class Column : uint8_t {
+    Usec,
+    Value,
+    Pad,
+    Type,
+    State,
+    _count
+  };
+
+  // The type of the values of a column.
+  enum class Type : uint8_t {
+    Unsigned,
+    Signed,
+    Float,
+  };
+
+  // All fields are naturally aligned without padding. The values are stored
+  // in the byte order of the writer, 'byteOrder' reads as 0x0102 if it matches
+  // the byte order of the reader.
+  struct Header {
+    // "V2DC"
+    char     magic[4];
+    uint16_t version;
+    uint16_t byteOrder;
+    uint16_t nColumns;
+    uint16_t reserved;
+
+    // The number of valid rows, and the allocated rows of every column.
+    uint32_t nRows;
+    uint32_t nRowsMax;
+
+    // The size of the entire block including the header.
+    uint32_t size;
+
+    struct {
+      // The position of the column from the start of the block.
+      uint32_t offset;
+
+      // The size in bytes and the type of a value.
+      uint8_t size;
+      Type    type;
+      uint8_t reserved[2];
+
+      // NUL-padded.
+      char name[8];
+    } columns[(uint8_t)Column::_count];
+  };
+
+  static_assert(offsetof(Header, columns) == 24, "Header layout");
+  static_assert(sizeof(Header::columns[0]) == 16, "Column layout");
+  static_assert(sizeof(Header) == 24 + 16 * (uint8_t)Column::_count, "Header layout");
+
+  // Append a row; the block is written out when it is full.
+  void append(const V2Drum::Event& event) {
+    _block.usec[_nRows]  = event.usec;
+    _block.value[_nRows] = event.value;
+    _block.pad[_nRows]   = event.pad;
+    _block.type[_nRows]  = (uint8_t)event.type;
+    _block.state[_nRows] = (uint8_t)event.state;
+
+    if (++_nRows == nBlockRows)
+      flush();
+  }
+
+  // Write out the current block, even if it is not full.
+  void flush() {
+    if (_nRows == 0)
+      return;
+
+    writeHeader();
+    handleWrite((const uint8_t*)&_block, sizeof(_block));
+    _nRows = 0;
+  }
+
+protected:
+  // Write the data to the output stream.
+  virtual void handleWrite(const uint8_t* data, uint32_t size) = 0;
+
+private:
+  // The columns are ordered by the size of their values, every column is aligned.
+  struct {
+    Header   header;
+    uint32_t usec[nBlockRows];
+    uint16_t value[nBlockRows];
+    uint8_t  pad[nBlockRows];
+    uint8_t  type[nBlockRows];
+    uint8_t  state[nBlockRows];
+  } _block{};
+
+  uint16_t _nRows{};
+
+  static_assert(sizeof(Header) % 4 == 0, "Column alignment");
+  static_assert(offsetof(decltype(_block), usec) == sizeof(Header), "Column layout");
+  static_assert(offsetof(decltype(_block), value) == sizeof(Header) + 4 * nBlockRows, "Column layout");
+  static_assert(offsetof(decltype(_block), pad) == sizeof(Header) + 6 * nBlockRows, "Column layout");
+
+  void writeHeader() {
+    Header* header = &_block.header;
+    memcpy(header->magic, "V2DC", 4);
+    header->version   = 1;
+    header->byteOrder = 0x0102;
+    header->nColumns  = (uint8_t)Column::_count;
+    header->nRows     = _nRows;
+    header->nRowsMax  = nBlockRows;
+    header->size      = sizeof(_block);
+
+    setColumn(Column::Usec, "usec", sizeof(uint32_t), (const uint8_t*)_block.usec);
+    setColumn(Column::Value, "value", sizeof(uint16_t), (const uint8_t*)_block.value);
+    setColumn(Column::Pad, "pad", sizeof(uint8_t), _block.pad);
+    setColumn(Column::Type, "type", sizeof(uint8_t), _block.type);
+    setColumn(Column::State, "state", sizeof(uint8_t), _block.state);
+  }
+
+  void setColumn(Column column, const char* name, uint8_t size, const uint8_t* data) {
+    auto* c   = &_block.header.columns[(uint8_t)column];
+    c->offset = data - (const uint8_t*)&_block;
+    c->size   = size;
+    c->type   = Type::Unsigned;
+    strncpy(c->name, name, sizeof(c->name));
+  }
+};
@@ -0,0 +1,108 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2024
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+#include "V2Drum.h"
+
+// CPU load estimator and scan governor. The busy time of the detectors is
+// measured around every scan of all pads, added up, and divided by the elapsed
+// time once per period. When the load approaches the ceiling, the pads are told
+// to shed work in steps, pressure output first, so the hit detection keeps its
+// deadline.
+class V2DrumLoad {
+public:
+  struct Config {
+    // The interval to measure the load, at least the sample period of the pads.
+    uint32_t periodUsec;
+
+    // The exponential smoothing constant of the load.
+    float alpha;
+
+    // The normalized 0..1 load to shed work at. The work is restored below
+    // the ceiling minus the hysteresis.
+    float ceiling;
+    float hysteresis;
+
+    // The minimum time between two changes of the level.
+    uint32_t holdUsec;
+  };
+
+  constexpr V2DrumLoad(const struct Config* config) : _config(config) {}
+
+  void reset(V2Drum* const* pads, uint8_t nPads) {
+    _usec       = 0;
+    _busyUsec   = 0;
+    _periodUsec = 0;
+    _changeUsec = 0;
+    _load       = 0;
+    _level      = V2Drum::Level::Full;
+
+    for (uint8_t i = 0; i < nPads; i++)
+      pads[i]->setLevel(_level);
+  }
+
+  // Call before the scan of all pads.
+  void begin() {
+    _usec = V2Base::getUsec();
+  }
+
+  // Call after the scan of all pads, the current level is applied to the pads.
+  void end(V2Drum* const* pads, uint8_t nPads) {
+    _busyUsec += V2Base::getUsecSince(_usec);
+
+    // Start the first measurement period.
+    if (_periodUsec == 0) {
+      _periodUsec = V2Base::getUsec();
+      _busyUsec   = 0;
+      return;
+    }
+
+    const uint32_t elapsed = V2Base::getUsecSince(_periodUsec);
+    if (elapsed < _config->periodUsec)
+      return;
+
+    const float busy = (float)_busyUsec / (float)elapsed;
+    _busyUsec        = 0;
+    _periodUsec      = V2Base::getUsec();
+
+    _load *= 1 - _config->alpha;
+    _load += busy * _config->alpha;
+
+    if (V2Base::getUsecSince(_changeUsec) < _config->holdUsec)
+      return;
+
+    V2Drum::Level level = _level;
+    if (_load > _config->ceiling && level < V2Drum::Level::SlowIdle)
+      level = (V2Drum::Level)((uint8_t)level + 1);
+
+    else if (_load < _config->ceiling - _config->hysteresis && level > V2Drum::Level::Full)
+      level = (V2Drum::Level)((uint8_t)level - 1);
+
+    if (level == _level)
+      return;
+
+    _level      = level;
+    _changeUsec = V2Base::getUsec();
+
+    for (uint8_t i = 0; i < nPads; i++)
+      pads[i]->setLevel(level);
+  }
+
+  // The normalized 0..1 load, e.g. for power management decisions.
+  float getLoad() {
+    return _load;
+  }
+
+  V2Drum::Level getLevel() {
+    return _level;
+  }
+
+private:
+  const struct Config* _config;
+  uint32_t             _usec{};
+  uint32_t             _busyUsec{};
+  uint32_t             _periodUsec{};
+  uint32_t             _changeUsec{};
+  float                _load{};
+  V2Drum::Level        _level{};
+};
@@ -0,0 +1,128 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2024
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+#include "V2Drum.h"
+
+// Event queue with several producers, e.g. the completion interrupts of
+// different ADCs, and a single consumer. Every producer owns a ring buffer, a
+// push never waits and never disables interrupts. The consumer merges the
+// rings in the order of the event timestamps. The number of events per
+// producer must be a power of two.
+//
+// After every completed scan, a producer publishes the timestamp of the scan as
+// its watermark; none of its later events can be older. The consumer releases
+// only the events which are not newer than the watermarks of all producers, so
+// the popped events are in global timestamp order, even when a slower producer
+// pushes an older event after a faster one. A producer which stops publishing
+// holds back the events of all producers.
+template <uint8_t nProducers, uint16_t nEvents> class V2DrumQueue {
+public:
+  // Called by the producer only. Returns false if the queue is full, the event
+  // is dropped and counted.
+  bool push(uint8_t producer, const V2Drum::Event& event) {
+    auto* p = &_producers[producer];
+
+    // Every event gets a sequence number, dropped ones leave a gap.
+    const uint32_t sequence = p->sequence++;
+
+    const uint32_t head = p->head;
+    if (head - __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) == nEvents) {
+      V2DRUM_PROBE(overflow, this, event.usec, producer);
+      __atomic_store_n(&p->nDropped, p->nDropped + 1, __ATOMIC_RELAXED);
+      return false;
+    }
+
+    p->entries[head & (nEvents - 1)] = {event, sequence};
+    __atomic_store_n(&p->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Called by the producer only, after all events of a scan are pushed.
+  void publish(uint8_t producer, uint32_t usec) {
+    auto* p = &_producers[producer];
+    __atomic_store_n(&p->watermark, usec, __ATOMIC_RELEASE);
+    if (!p->published)
+      __atomic_store_n(&p->published, true, __ATOMIC_RELEASE);
+  }
+
+  // Called by the consumer only. Returns the oldest queued event of all
+  // producers, if it is not newer than the watermark of any producer; the
+  // producer and its sequence number are optional. A gap in the sequence
+  // numbers of a producer indicates dropped events.
+  bool pop(V2Drum::Event* event, uint8_t* producer = nullptr, uint32_t* sequence = nullptr) {
+    // The oldest watermark of all producers.
+    uint32_t watermark;
+    for (uint8_t i = 0; i < nProducers; i++) {
+      auto* p = &_producers[i];
+      if (!__atomic_load_n(&p->published, __ATOMIC_ACQUIRE))
+        return false;
+
+      const uint32_t usec = __atomic_load_n(&p->watermark, __ATOMIC_ACQUIRE);
+      if (i == 0 || (int32_t)(usec - watermark) < 0)
+        watermark = usec;
+    }
+
+    int16_t oldest = -1;
+
+    for (uint8_t i = 0; i < nProducers; i++) {
+      auto* p = &_producers[i];
+
+      const uint32_t tail = p->tail;
+      if (__atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == tail)
+        continue;
+
+      if (oldest < 0) {
+        oldest = i;
+        continue;
+      }
+
+      const uint32_t usec = p->entries[tail & (nEvents - 1)].event.usec;
+      auto*          o    = &_producers[oldest];
+      if ((int32_t)(usec - o->entries[o->tail & (nEvents - 1)].event.usec) < 0)
+        oldest = i;
+    }
+
+    if (oldest < 0)
+      return false;
+
+    auto*       p     = &_producers[oldest];
+    const auto* entry = &p->entries[p->tail & (nEvents - 1)];
+    if ((int32_t)(entry->event.usec - watermark) > 0)
+      return false;
+
+    *event            = entry->event;
+
+    if (producer)
+      *producer = oldest;
+
+    if (sequence)
+      *sequence = entry->sequence;
+
+    __atomic_store_n(&p->tail, p->tail + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // The number of dropped events of a producer.
+  uint32_t getDropped(uint8_t producer) {
+    return __atomic_load_n(&_producers[producer].nDropped, __ATOMIC_RELAXED);
+  }
+
+private:
+  struct {
+    struct {
+      V2Drum::Event event;
+      uint32_t      sequence;
+    } entries[nEvents];
+
+    // Written by the producer.
+    uint32_t head;
+    uint32_t sequence;
+    uint32_t nDropped;
+    uint32_t watermark;
+    bool     published;
+
+    // Written by the consumer.
+    uint32_t tail;
+  } _producers[nProducers]{};
+};
@@ -0,0 +1,177 @@
+// © Kay Sievers <kay@versioduo.com>, 2020-2024
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+#include "V2Drum.h"
+
+#if defined(__cpp_impl_coroutine)
+  #include <coroutine>
+  #include <exception>
+
+// Coroutine which consumes a V2DrumStream. The frames are allocated from a
+// fixed pool instead of the heap; if the pool is exhausted, the returned task
+// is not valid.
+class V2DrumTask {
+public:
+  // The number of concurrently existing tasks, and the maximum size of a frame.
+  static constexpr uint8_t  nFrames    = 8;
+  static constexpr uint16_t nFrameSize = 1024;
+
+  struct promise_type {
+    V2DrumTask get_return_object() {
+      return V2DrumTask(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    static V2DrumTask get_return_object_on_allocation_failure() {
+      return V2DrumTask({});
+    }
+
+    std::suspend_never initial_suspend() noexcept {
+      return {};
+    }
+
+    std::suspend_always final_suspend() noexcept {
+      return {};
+    }
+
+    void return_void() {}
+    void unhandled_exception() {
+      std::terminate();
+    }
+
+    static void* operator new(size_t size) noexcept {
+      if (size > nFrameSize)
+        return nullptr;
+
+      for (uint8_t i = 0; i < nFrames; i++) {
+        if (_frames.used[i])
+          continue;
+
+        _frames.used[i] = true;
+        return _frames.data[i];
+      }
+
+      return nullptr;
+    }
+
+    static void operator delete(void* frame) noexcept {
+      for (uint8_t i = 0; i < nFrames; i++)
+        if (frame == _frames.data[i])
+          _frames.used[i] = false;
+    }
+  };
+
+  V2DrumTask(V2DrumTask&& task) noexcept : _handle(task._handle) {
+    task._handle = {};
+  }
+
+  ~V2DrumTask() {
+    if (_handle)
+      _handle.destroy();
+  }
+
+  bool isValid() {
+    return (bool)_handle;
+  }
+
+  bool isDone() {
+    return !_handle || _handle.done();
+  }
+
+private:
+  std::coroutine_handle<promise_type> _handle;
+
+  static inline struct {
+    alignas(max_align_t) uint8_t data[nFrames][nFrameSize];
+    bool used[nFrames];
+  } _frames{};
+
+  explicit V2DrumTask(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+};
+
+// Asynchronous event stream of a group of pads. The producer pushes the events
+// of a scan and calls flush(); a consumer waiting in 'co_await stream.next()'
+// is resumed once with all events collected since its last batch. Events are
+// double-buffered, a batch stays valid until the next 'co_await'. Producer and
+// consumer run in the same thread, the consumer is resumed from flush().
+template <uint16_t nEvents> class V2DrumStream {
+public:
+  struct Batch {
+    const V2Drum::Event* events;
+    uint16_t             count;
+  };
+
+  // Returns false if the buffer is full, the event is dropped and counted.
+  bool push(const V2Drum::Event& event) {
+    auto* buffer = &_buffers[_fill];
+    if (buffer->count == nEvents) {
+      _nDropped++;
+      return false;
+    }
+
+    buffer->events[buffer->count++] = event;
+    return true;
+  }
+
+  // Resume the waiting consumer with the collected events.
+  void flush() {
+    if (!_waiting || _buffers[_fill].count == 0)
+      return;
+
+    const auto handle = _waiting;
+    _waiting          = {};
+    handle.resume();
+  }
+
+  auto next() {
+    struct Awaiter {
+      V2DrumStream*           stream;
+      std::coroutine_handle<> handle;
+
+      // The awaiter lives in the coroutine frame; if the task is destroyed while
+      // it waits, the stream must not resume it.
+      ~Awaiter() {
+        if (handle && stream->_waiting == handle)
+          stream->_waiting = {};
+      }
+
+      bool await_ready() {
+        return stream->_buffers[stream->_fill].count > 0;
+      }
+
+      void await_suspend(std::coroutine_handle<> h) {
+        handle           = h;
+        stream->_waiting = h;
+      }
+
+      Batch await_resume() {
+        return stream->swap();
+      }
+    };
+
+    return Awaiter{this, {}};
+  }
+
+  uint32_t getDropped() {
+    return _nDropped;
+  }
+
+private:
+  struct {
+    V2Drum::Event events[nEvents];
+    uint16_t      count;
+  } _buffers[2]{};
+
+  uint8_t                 _fill{};
+  uint32_t                _nDropped{};
+  std::coroutine_handle<> _waiting{};
+
+  // Hand the filled buffer to the consumer, and continue with the other one.
+  Batch swap() {
+    auto* buffer = &_buffers[_fill];
+    _fill ^= 1;
+    _buffers[_fill].count = 0;
+    return {buffer->events, buffer->count};
+  }
+};
+#endif